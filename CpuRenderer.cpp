@@ -0,0 +1,397 @@
+#pragma once
+#include <chrono>
+#include <cmath>
+#include <vector>
+#include <glm/glm.hpp>
+#include "SparseVoxelOctree.cpp"
+
+using glm::vec3;
+using namespace std;
+
+// ----------------------------------------------------------------------------
+// STRUCTS
+
+struct Camera {
+    vec3 position;
+    vec3 forward;
+    vec3 up = vec3(0.0f, 1.0f, 0.0f);
+    float fov = glm::radians(60.0f); // Vertical field of view
+};
+
+struct ViewBasis {
+    vec3 position;
+    vec3 forward;
+    vec3 right;
+    vec3 up;
+    float halfHeight;
+    float aspect;
+};
+
+struct CachedHit {
+    vec3 hitPos;
+    float distance = -1.0f; // Negative when the pixel has no hit
+    int fullSteps = 0;      // Steps the last full traversal to this surface took
+};
+
+struct FrameStats {
+    double frameMs = 0.0;
+    double smoothedMs = 0.0;
+    double targetMs = 0.0;
+    float renderScale = 1.0f;
+    int internalWidth = 0;
+    int internalHeight = 0;
+    int raysCast = 0;
+    int hits = 0;
+    int traversalSteps = 0;
+    int cacheHits = 0;    // Reprojected and verified by a short local traversal
+    int cacheRejects = 0; // Reprojected but failed verification
+    int cacheMisses = 0;  // Nothing usable reprojected onto the pixel (disocclusion or background)
+    int savedSteps = 0;
+};
+
+/*
+* CPU ray caster for the SVO with a frame time budget. Every frame is timed and
+* the internal resolution is scaled up or down to stay within the target frame
+* time, then upscaled to the output size.
+*
+* Hits from the previous frame are kept in a per-pixel cache. Each frame they are
+* reprojected into the new view and verified with a short traversal starting just
+* before the cached hit, falling back to a full traversal when that fails. Hits
+* that land clearly behind their neighbours are treated as disoccluded.
+*/
+class CpuRenderer {
+private:
+    SparseVoxelOctree& svo;
+    int outputWidth;
+    int outputHeight;
+    double targetFrameMs;
+
+    float renderScale = 1.0f;
+    float minScale = 0.25f;
+    float maxScale = 1.0f;
+    double smoothedMs = 0.0;
+
+    vector<uint32_t> internalBuffer;
+    vector<uint32_t> outputBuffer;
+    FrameStats lastStats;
+
+    bool temporalReprojection = true;
+    int localTraversalSteps = 8;
+    float disocclusionDepth = 0.05f; // Relative depth step to a neighbour that marks a pixel as disoccluded
+    vector<CachedHit> hitCache;
+    vector<CachedHit> reprojected;
+
+    vec3 skyColor = vec3(0.2f, 0.3f, 0.3f);
+    vec3 lightDir = glm::normalize(vec3(0.4f, 1.0f, 0.3f));
+
+    uint32_t packColor(vec3 color) {
+        color = glm::clamp(color, 0.0f, 1.0f);
+        uint32_t r = uint32_t(color.r * 255.0f);
+        uint32_t g = uint32_t(color.g * 255.0f);
+        uint32_t b = uint32_t(color.b * 255.0f);
+        return r | g << 8 | b << 16 | 0xFFu << 24;
+    }
+
+    float volumeSize() {
+        return (float)svo.getSize();
+    }
+
+    float voxelSize() {
+        return svo.getSize() / (float)exp2(svo.getMaxDepth());
+    }
+
+    ViewBasis makeBasis(const Camera& camera) {
+        ViewBasis view;
+        view.position = camera.position;
+        view.forward = glm::normalize(camera.forward);
+        view.right = glm::normalize(glm::cross(view.forward, camera.up));
+        view.up = glm::cross(view.right, view.forward);
+        view.halfHeight = tan(camera.fov * 0.5f);
+        view.aspect = outputWidth / (float)outputHeight;
+        return view;
+    }
+
+    vec3 rayDirection(const ViewBasis& view, float u, float v) {
+        return glm::normalize(view.forward + view.right * (u * view.halfHeight * view.aspect) + view.up * (v * view.halfHeight));
+    }
+
+    uint32_t shade(const Intersection& intersection) {
+        float diffuse = 1.0f;
+        if (intersection.normal != vec3(0.0f)) {
+            diffuse = 0.3f + 0.7f * max(0.0f, glm::dot(intersection.normal, lightDir));
+        }
+        return packColor(intersection.color * diffuse);
+    }
+
+    // Scatters last frame's hits into the current view, keeping the nearest one per pixel
+    void reprojectCache(const ViewBasis& view, int width, int height) {
+        PROFILE_SCOPE("CpuRenderer::reprojectCache");
+        reprojected.assign(width * height, CachedHit());
+        for (const CachedHit& cached : hitCache) {
+            if (cached.distance < 0.0f) continue;
+
+            vec3 rel = cached.hitPos - view.position;
+            float z = glm::dot(rel, view.forward);
+            if (z <= 0.0f) continue;
+
+            float u = glm::dot(rel, view.right) / (z * view.halfHeight * view.aspect);
+            float v = glm::dot(rel, view.up) / (z * view.halfHeight);
+            int x = (int)floor((u + 1.0f) * 0.5f * width);
+            int y = (int)floor((v + 1.0f) * 0.5f * height);
+            if (x < 0 || x >= width || y < 0 || y >= height) continue;
+
+            CachedHit& target = reprojected[y * width + x];
+            float distance = glm::length(rel);
+            if (target.distance < 0.0f || distance < target.distance) {
+                target = cached;
+                target.distance = distance;
+            }
+        }
+    }
+
+    // The short traversal can't see anything in front of the cached hit. A hit that is
+    // clearly behind one of its reprojected neighbours is most likely showing through
+    // a gap in a nearer surface, one that grew on screen or was just uncovered, so it
+    // is traced in full instead
+    bool isDisoccluded(int x, int y, int width, int height) {
+        float distance = reprojected[y * width + x].distance;
+        float tolerance = max(2.0f * voxelSize(), distance * disocclusionDepth);
+        for (int ny = max(0, y - 1); ny <= min(height - 1, y + 1); ny++) {
+            for (int nx = max(0, x - 1); nx <= min(width - 1, x + 1); nx++) {
+                float neighbour = reprojected[ny * width + nx].distance;
+                if (neighbour >= 0.0f && neighbour < distance - tolerance) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Short traversal starting a couple of voxels before the cached hit distance
+    bool traceFromCache(vec3 origin, vec3 d, float tEnter, float cachedDistance, Intersection& intersection) {
+        float margin = 2.0f * voxelSize();
+        float minStart = tEnter + volumeSize() * 1e-5f;
+        float startT = max(minStart, cachedDistance - margin);
+        if (!svo.ClosestIntersection(origin + d * startT, d, intersection, localTraversalSteps)) {
+            return false;
+        }
+
+        // Starting inside a voxel means the ray already hit something before the cached surface
+        if (intersection.steps <= 1 && startT > minStart) {
+            return false;
+        }
+
+        intersection.distance += startT;
+        return intersection.distance <= cachedDistance + margin;
+    }
+
+    void renderInternal(const Camera& camera, int width, int height) {
+        PROFILE_SCOPE("CpuRenderer::renderInternal");
+        ViewBasis view = makeBasis(camera);
+        bool useCache = temporalReprojection && !hitCache.empty();
+        if (useCache) {
+            reprojectCache(view, width, height);
+        }
+
+        internalBuffer.resize(width * height);
+        vector<CachedHit> newCache(width * height);
+        lastStats.raysCast = 0;
+        lastStats.hits = 0;
+        lastStats.traversalSteps = 0;
+        lastStats.cacheHits = 0;
+        lastStats.cacheRejects = 0;
+        lastStats.cacheMisses = 0;
+        lastStats.savedSteps = 0;
+
+        for (int y = 0; y < height; y++) {
+            // Row 0 is the bottom of the image, matching glTexImage2D
+            float v = ((y + 0.5f) / height) * 2.0f - 1.0f;
+            for (int x = 0; x < width; x++) {
+                float u = ((x + 0.5f) / width) * 2.0f - 1.0f;
+                int index = y * width + x;
+                vec3 d = rayDirection(view, u, v);
+                lastStats.raysCast++;
+
+                float tEnter;
+                if (!svo.clipRay(view.position, d, tEnter)) {
+                    internalBuffer[index] = packColor(skyColor);
+                    continue;
+                }
+
+                Intersection intersection;
+                bool hit = false;
+                int fullSteps = 0;
+                if (useCache && reprojected[index].distance >= 0.0f && !isDisoccluded(x, y, width, height)) {
+                    const CachedHit& cached = reprojected[index];
+                    hit = traceFromCache(view.position, d, tEnter, cached.distance, intersection);
+                    lastStats.traversalSteps += intersection.steps;
+                    if (hit) {
+                        fullSteps = cached.fullSteps;
+                        lastStats.cacheHits++;
+                        lastStats.savedSteps += max(0, cached.fullSteps - intersection.steps);
+                    }
+                    else {
+                        lastStats.cacheRejects++;
+                    }
+                }
+                else if (useCache) {
+                    lastStats.cacheMisses++;
+                }
+
+                if (!hit) {
+                    hit = svo.castRay(view.position, d, intersection);
+                    lastStats.traversalSteps += intersection.steps;
+                    fullSteps = intersection.steps;
+                }
+
+                if (!hit) {
+                    internalBuffer[index] = packColor(skyColor);
+                    continue;
+                }
+
+                lastStats.hits++;
+                internalBuffer[index] = shade(intersection);
+                newCache[index].hitPos = view.position + d * intersection.distance;
+                newCache[index].distance = intersection.distance;
+                newCache[index].fullSteps = fullSteps;
+            }
+        }
+        hitCache.swap(newCache);
+        PROFILE_COUNTER("rays cast", lastStats.raysCast);
+        PROFILE_COUNTER("traversal steps", lastStats.traversalSteps);
+    }
+
+    uint32_t lerpColor(uint32_t a, uint32_t b, float t) {
+        uint32_t result = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            float ca = (float)((a >> shift) & 0xFFu);
+            float cb = (float)((b >> shift) & 0xFFu);
+            result |= uint32_t(ca + (cb - ca) * t + 0.5f) << shift;
+        }
+        return result;
+    }
+
+    // Bilinear upscale of the internal buffer to the output size
+    void upscale(int width, int height) {
+        PROFILE_SCOPE("CpuRenderer::upscale");
+        outputBuffer.resize(outputWidth * outputHeight);
+        if (width == outputWidth && height == outputHeight) {
+            outputBuffer = internalBuffer;
+            return;
+        }
+
+        float scaleX = width / (float)outputWidth;
+        float scaleY = height / (float)outputHeight;
+        for (int y = 0; y < outputHeight; y++) {
+            float sy = glm::clamp((y + 0.5f) * scaleY - 0.5f, 0.0f, (float)(height - 1));
+            int y0 = (int)sy;
+            int y1 = min(y0 + 1, height - 1);
+            float ty = sy - y0;
+            for (int x = 0; x < outputWidth; x++) {
+                float sx = glm::clamp((x + 0.5f) * scaleX - 0.5f, 0.0f, (float)(width - 1));
+                int x0 = (int)sx;
+                int x1 = min(x0 + 1, width - 1);
+                float tx = sx - x0;
+
+                uint32_t top = lerpColor(internalBuffer[y0 * width + x0], internalBuffer[y0 * width + x1], tx);
+                uint32_t bottom = lerpColor(internalBuffer[y1 * width + x0], internalBuffer[y1 * width + x1], tx);
+                outputBuffer[y * outputWidth + x] = lerpColor(top, bottom, ty);
+            }
+        }
+    }
+
+    void adjustScale(double frameMs) {
+        // Smooth the measurement so a single slow frame doesn't cause a large jump
+        const double smoothing = 0.2;
+        smoothedMs = smoothedMs <= 0.0 ? frameMs : smoothedMs + (frameMs - smoothedMs) * smoothing;
+
+        // Don't touch the scale while within 5% of the budget to avoid oscillation
+        double ratio = targetFrameMs / smoothedMs;
+        if (ratio > 0.95 && ratio < 1.05) {
+            return;
+        }
+
+        // Cost scales with pixel count, so the linear scale follows the square root
+        float newScale = renderScale * (float)sqrt(ratio);
+        newScale = glm::mix(renderScale, newScale, 0.5f);
+        renderScale = glm::clamp(newScale, minScale, maxScale);
+    }
+public:
+    CpuRenderer(SparseVoxelOctree& svo, int outputWidth, int outputHeight, double targetFrameMs)
+        : svo(svo), outputWidth(outputWidth), outputHeight(outputHeight), targetFrameMs(targetFrameMs) {
+    }
+
+    void setTargetFrameTime(double ms) {
+        targetFrameMs = ms;
+    }
+
+    void setScaleLimits(float minRenderScale, float maxRenderScale) {
+        minScale = minRenderScale;
+        maxScale = maxRenderScale;
+        renderScale = glm::clamp(renderScale, minScale, maxScale);
+    }
+
+    void setTemporalReprojection(bool enabled) {
+        temporalReprojection = enabled;
+        invalidateCache();
+    }
+
+    // Must be called when the SVO changes, cached hits are only valid for a static scene
+    void invalidateCache() {
+        hitCache.clear();
+    }
+
+    void setOutputSize(int width, int height) {
+        outputWidth = width;
+        outputHeight = height;
+    }
+
+    int getOutputWidth() {
+        return outputWidth;
+    }
+
+    int getOutputHeight() {
+        return outputHeight;
+    }
+
+    const FrameStats& getLastFrameStats() {
+        return lastStats;
+    }
+
+    // Renders a frame into an RGBA8 buffer of the output size, rows bottom to top
+    const vector<uint32_t>& renderFrame(const Camera& camera) {
+        PROFILE_SCOPE("CpuRenderer::renderFrame");
+        auto start = chrono::steady_clock::now();
+
+        int width = max(1, (int)(outputWidth * renderScale));
+        int height = max(1, (int)(outputHeight * renderScale));
+        lastStats.renderScale = renderScale;
+        lastStats.internalWidth = width;
+        lastStats.internalHeight = height;
+
+        renderInternal(camera, width, height);
+        upscale(width, height);
+
+        double frameMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        adjustScale(frameMs);
+
+        lastStats.frameMs = frameMs;
+        lastStats.smoothedMs = smoothedMs;
+        lastStats.targetMs = targetFrameMs;
+        return outputBuffer;
+    }
+};
+
+// Interpolates linearly between keyframes, t goes from 0 to 1 over the whole path
+Camera cameraOnPath(const vector<Camera>& keyframes, float t) {
+    if (keyframes.size() == 1) return keyframes[0];
+
+    float segment = glm::clamp(t, 0.0f, 1.0f) * (keyframes.size() - 1);
+    int i = min((int)segment, (int)keyframes.size() - 2);
+    float local = segment - i;
+
+    Camera camera = keyframes[i];
+    camera.position = glm::mix(keyframes[i].position, keyframes[i + 1].position, local);
+    camera.forward = glm::normalize(glm::mix(keyframes[i].forward, keyframes[i + 1].forward, local));
+    return camera;
+}
@@ -0,0 +1,334 @@
+#pragma once
+#include <glad/glad.h>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+#include "SparseVoxelOctree.cpp"
+
+using namespace std;
+
+// ----------------------------------------------------------------------------
+// STRUCTS
+
+typedef uint64_t UploadFence; // 0 means no fence
+
+struct DirtyRange {
+    size_t first; // In nodes
+    size_t count;
+};
+
+struct UploadStats {
+    size_t bytesUploaded = 0;
+    int rangesUploaded = 0;
+    int slotsUsed = 0;
+    double stallMs = 0.0; // Time spent waiting for staging slots to be released
+    bool reallocated = false;
+};
+
+/*
+* Where the upload stage writes to. The device buffer is written through
+* persistently mapped staging slots, and fences tell when a slot can be reused.
+* allocate() may replace the device buffer, so a backend has to leave it
+* wherever the renderer reads it from (GLUploadBackend rebinds its SSBO binding
+* point), and UploadStats::reallocated is set whenever that happened.
+*/
+class UploadBackend {
+public:
+    virtual ~UploadBackend() {}
+
+    // Creates the device buffer and the staging slots, dropping any previous contents
+    virtual void allocate(size_t bufferBytes, int slotCount, size_t slotBytes) = 0;
+    virtual uint8_t* stagingPointer(int slot) = 0;
+    virtual void copyToBuffer(int slot, size_t stagingOffset, size_t bufferOffset, size_t bytes) = 0;
+    virtual UploadFence insertFence() = 0;
+    virtual void waitFence(UploadFence fence) = 0;
+};
+
+/*
+* OpenGL backend, needs GL 4.4 for persistently mapped buffers. The node buffer
+* is bound to the given shader storage binding point every time it is allocated.
+*/
+class GLUploadBackend : public UploadBackend {
+private:
+    GLuint bindingPoint;
+    GLuint buffer = 0;
+    GLuint stagingBuffer = 0;
+    uint8_t* stagingMemory = nullptr;
+    size_t slotBytes = 0;
+    UploadFence nextFence = 1;
+    unordered_map<UploadFence, GLsync> fences;
+
+public:
+    // Must be called while the GL context is still current
+    void release() {
+        for (auto& fence : fences) {
+            glDeleteSync(fence.second);
+        }
+        fences.clear();
+        if (stagingBuffer) {
+            glBindBuffer(GL_COPY_WRITE_BUFFER, stagingBuffer);
+            glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            glDeleteBuffers(1, &stagingBuffer);
+        }
+        if (buffer) {
+            glDeleteBuffers(1, &buffer);
+        }
+        buffer = stagingBuffer = 0;
+        stagingMemory = nullptr;
+    }
+
+    GLUploadBackend(GLuint bindingPoint) : bindingPoint(bindingPoint) {
+    }
+
+    ~GLUploadBackend() {
+        release();
+    }
+
+    GLuint getBuffer() {
+        return buffer;
+    }
+
+    void allocate(size_t bufferBytes, int slotCount, size_t slotBytes) override {
+        release();
+        this->slotBytes = slotBytes;
+
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, bufferBytes, NULL, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, bindingPoint, buffer);
+
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &stagingBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, stagingBuffer);
+        glBufferStorage(GL_COPY_WRITE_BUFFER, slotCount * slotBytes, NULL, flags);
+        stagingMemory = (uint8_t*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, slotCount * slotBytes, flags);
+    }
+
+    uint8_t* stagingPointer(int slot) override {
+        return stagingMemory + slot * slotBytes;
+    }
+
+    void copyToBuffer(int slot, size_t stagingOffset, size_t bufferOffset, size_t bytes) override {
+        glBindBuffer(GL_COPY_READ_BUFFER, stagingBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, slot * slotBytes + stagingOffset, bufferOffset, bytes);
+    }
+
+    UploadFence insertFence() override {
+        UploadFence fence = nextFence++;
+        fences[fence] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        return fence;
+    }
+
+    void waitFence(UploadFence fence) override {
+        auto found = fences.find(fence);
+        if (found == fences.end()) return;
+
+        // Wait in 1 ms steps, flushing on the first wait so the fence is guaranteed to signal
+        const GLuint64 timeoutNs = 1000000;
+        GLenum result = glClientWaitSync(found->second, GL_SYNC_FLUSH_COMMANDS_BIT, timeoutNs);
+        while (result == GL_TIMEOUT_EXPIRED) {
+            result = glClientWaitSync(found->second, 0, timeoutNs);
+        }
+        if (result == GL_WAIT_FAILED) {
+            std::cout << "ERROR::UPLOAD::FENCE_WAIT_FAILED" << std::endl;
+        }
+        glDeleteSync(found->second);
+        fences.erase(found);
+    }
+};
+
+/*
+* In-memory stand-in for the GPU, used to test and benchmark the upload stage
+* without a GL context. Fences complete a fixed number of fences later to mimic
+* the GPU running behind the CPU.
+*/
+class MemoryUploadBackend : public UploadBackend {
+private:
+    vector<uint8_t> buffer;
+    vector<vector<uint8_t>> staging;
+    UploadFence lastFence = 0;
+    UploadFence completedFence = 0;
+    int latencyFences;
+public:
+    int stalledWaits = 0; // Waits on fences the simulated GPU hadn't reached yet
+
+    MemoryUploadBackend(int latencyFences = 2) : latencyFences(latencyFences) {
+    }
+
+    const vector<uint8_t>& getBuffer() {
+        return buffer;
+    }
+
+    void allocate(size_t bufferBytes, int slotCount, size_t slotBytes) override {
+        buffer.assign(bufferBytes, 0);
+        staging.assign(slotCount, vector<uint8_t>(slotBytes));
+    }
+
+    uint8_t* stagingPointer(int slot) override {
+        return staging[slot].data();
+    }
+
+    void copyToBuffer(int slot, size_t stagingOffset, size_t bufferOffset, size_t bytes) override {
+        memcpy(buffer.data() + bufferOffset, staging[slot].data() + stagingOffset, bytes);
+    }
+
+    UploadFence insertFence() override {
+        lastFence++;
+        if (lastFence > (UploadFence)latencyFences) {
+            completedFence = max(completedFence, lastFence - latencyFences);
+        }
+        return lastFence;
+    }
+
+    void waitFence(UploadFence fence) override {
+        if (fence > completedFence) {
+            stalledWaits++;
+            completedFence = fence;
+        }
+    }
+};
+
+/*
+* Upload stage between the flattened node array and the renderer. Each upload
+* diffs the array against what was uploaded last time, copies only the changed
+* ranges into the next of the double or triple buffered staging slots and
+* submits them, without waiting unless that slot is still in use by the GPU.
+*/
+class NodeBufferUploader {
+private:
+    UploadBackend& backend;
+    int slotCount;
+    size_t slotBytes;
+    size_t capacity = 0; // In nodes
+
+    vector<uint64_t> uploaded; // Mirror of the device buffer contents
+    vector<UploadFence> slotFences;
+    int currentSlot = 0;
+    UploadStats lastStats;
+
+    // Unchanged runs shorter than this are uploaded anyway to avoid tiny copies
+    const size_t mergeGap = 8;
+
+    vector<DirtyRange> findDirtyRanges(const vector<uint64_t>& nodes) {
+        vector<DirtyRange> ranges;
+        size_t common = min(nodes.size(), uploaded.size());
+        size_t i = 0;
+        while (i < common) {
+            if (nodes[i] == uploaded[i]) {
+                i++;
+                continue;
+            }
+
+            size_t first = i;
+            size_t last = i;
+            while (i < common) {
+                if (nodes[i] != uploaded[i]) {
+                    last = i;
+                }
+                else if (i - last > mergeGap) {
+                    break;
+                }
+                i++;
+            }
+            ranges.push_back({ first, last - first + 1 });
+        }
+
+        // Everything past the old end is new
+        if (nodes.size() > common) {
+            if (!ranges.empty() && common - (ranges.back().first + ranges.back().count) <= mergeGap) {
+                ranges.back().count = nodes.size() - ranges.back().first;
+            }
+            else {
+                ranges.push_back({ common, nodes.size() - common });
+            }
+        }
+        return ranges;
+    }
+
+    void waitForSlot(int slot) {
+        if (!slotFences[slot]) return;
+
+        auto start = chrono::steady_clock::now();
+        backend.waitFence(slotFences[slot]);
+        lastStats.stallMs += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        slotFences[slot] = 0;
+    }
+
+    void reallocate(size_t nodeCount) {
+        for (int slot = 0; slot < slotCount; slot++) {
+            waitForSlot(slot);
+        }
+
+        // Leave headroom so a growing tree doesn't reallocate on every edit
+        capacity = nodeCount + nodeCount / 2;
+        backend.allocate(capacity * sizeof(uint64_t), slotCount, slotBytes);
+        uploaded.clear();
+        lastStats.reallocated = true;
+    }
+public:
+    NodeBufferUploader(UploadBackend& backend, int slotCount = 3, size_t slotBytes = 4 * 1024 * 1024)
+        : backend(backend), slotCount(slotCount), slotBytes(slotBytes), slotFences(slotCount, 0) {
+    }
+
+    const UploadStats& getLastUploadStats() {
+        return lastStats;
+    }
+
+    const UploadStats& upload(const vector<uint64_t>& nodes) {
+        PROFILE_SCOPE("NodeBufferUploader::upload");
+        lastStats = UploadStats();
+        if (nodes.size() > capacity) {
+            reallocate(nodes.size());
+        }
+
+        vector<DirtyRange> ranges = findDirtyRanges(nodes);
+        if (ranges.empty()) {
+            return lastStats;
+        }
+
+        waitForSlot(currentSlot);
+        lastStats.slotsUsed = 1;
+        size_t stagingOffset = 0;
+
+        for (const DirtyRange& range : ranges) {
+            size_t byteOffset = range.first * sizeof(uint64_t);
+            size_t bytesLeft = range.count * sizeof(uint64_t);
+            const uint8_t* source = reinterpret_cast<const uint8_t*>(nodes.data()) + byteOffset;
+
+            while (bytesLeft > 0) {
+                // Move on to the next slot when this one is full
+                if (stagingOffset == slotBytes) {
+                    slotFences[currentSlot] = backend.insertFence();
+                    currentSlot = (currentSlot + 1) % slotCount;
+                    waitForSlot(currentSlot);
+                    lastStats.slotsUsed++;
+                    stagingOffset = 0;
+                }
+
+                size_t bytes = min(bytesLeft, slotBytes - stagingOffset);
+                memcpy(backend.stagingPointer(currentSlot) + stagingOffset, source, bytes);
+                backend.copyToBuffer(currentSlot, stagingOffset, byteOffset, bytes);
+
+                stagingOffset += bytes;
+                byteOffset += bytes;
+                source += bytes;
+                bytesLeft -= bytes;
+                lastStats.bytesUploaded += bytes;
+            }
+            lastStats.rangesUploaded++;
+        }
+
+        slotFences[currentSlot] = backend.insertFence();
+        currentSlot = (currentSlot + 1) % slotCount;
+
+        uploaded.resize(nodes.size());
+        for (const DirtyRange& range : ranges) {
+            copy(nodes.begin() + range.first, nodes.begin() + range.first + range.count, uploaded.begin() + range.first);
+        }
+
+        PROFILE_COUNTER("bytes uploaded", lastStats.bytesUploaded);
+        return lastStats;
+    }
+};
@@ -0,0 +1,193 @@
+#pragma once
+
+// Scoped timers and counters that can be written out as Chrome trace_event JSON
+// (open in chrome://tracing or ui.perfetto.dev). Define ENABLE_PROFILING to turn
+// them on, otherwise every PROFILE_ macro compiles to nothing. Each thread only
+// keeps its most recent events, so the trace covers the last stretch of a long run.
+//
+//   PROFILE_SCOPE("name")          times the enclosing scope
+//   PROFILE_COUNTER("name", delta) adds to a global counter
+//   PROFILE_SAMPLE_COUNTERS()      records the current value of every counter
+//   PROFILE_WRITE_TRACE("path")    writes everything recorded so far
+
+#ifdef ENABLE_PROFILING
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// ----------------------------------------------------------------------------
+// STRUCTS
+
+struct TraceEvent {
+    const char* name;
+    char phase;        // 'X' for a timed scope, 'C' for a counter sample
+    double timestampUs;
+    double durationUs;
+    long long value;
+};
+
+struct ThreadEvents {
+    int threadId;
+    mutex eventMutex;  // Only contended while a trace is being written
+    vector<TraceEvent> events; // Ring buffer once full, the oldest event is at next
+    size_t next = 0;
+};
+
+struct ProfileCounter {
+    const char* name;
+    atomic<long long> value{ 0 };
+};
+
+/*
+* Collects trace events from all threads. Every thread records into its own
+* buffer so timers on different threads don't contend with each other.
+*/
+class Profiler {
+private:
+    static const size_t maxEventsPerThread = 1 << 16;
+
+    chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+    mutex registryMutex;
+    vector<unique_ptr<ThreadEvents>> threads;
+    vector<unique_ptr<ProfileCounter>> counters;
+
+    ThreadEvents& threadEvents() {
+        thread_local ThreadEvents* events = nullptr;
+        if (!events) {
+            lock_guard<mutex> lock(registryMutex);
+            threads.push_back(make_unique<ThreadEvents>());
+            events = threads.back().get();
+            events->threadId = (int)threads.size();
+        }
+        return *events;
+    }
+
+    void record(const TraceEvent& event) {
+        ThreadEvents& events = threadEvents();
+        lock_guard<mutex> lock(events.eventMutex);
+        if (events.events.size() < maxEventsPerThread) {
+            events.events.push_back(event);
+            return;
+        }
+        events.events[events.next] = event;
+        events.next = (events.next + 1) % maxEventsPerThread;
+    }
+
+    void writeEscaped(ofstream& file, const char* text) {
+        for (const char* c = text; *c; c++) {
+            if (*c == '"' || *c == '\\') file << '\\';
+            file << *c;
+        }
+    }
+public:
+    static Profiler& get() {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    double nowUs() {
+        return chrono::duration<double, micro>(chrono::steady_clock::now() - startTime).count();
+    }
+
+    void addScope(const char* name, double startUs, double endUs) {
+        record({ name, 'X', startUs, endUs - startUs, 0 });
+    }
+
+    ProfileCounter* counter(const char* name) {
+        lock_guard<mutex> lock(registryMutex);
+        for (auto& counter : counters) {
+            if (string(counter->name) == name) return counter.get();
+        }
+        counters.push_back(make_unique<ProfileCounter>());
+        counters.back()->name = name;
+        return counters.back().get();
+    }
+
+    void sampleCounters() {
+        double now = nowUs();
+        vector<TraceEvent> samples;
+        {
+            lock_guard<mutex> lock(registryMutex);
+            for (auto& counter : counters) {
+                samples.push_back({ counter->name, 'C', now, 0.0, counter->value.load() });
+            }
+        }
+        for (const TraceEvent& sample : samples) {
+            record(sample);
+        }
+    }
+
+    bool writeChromeTrace(const string& path) {
+        ofstream file(path);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open trace file: " << path << std::endl;
+            return false;
+        }
+
+        lock_guard<mutex> registryLock(registryMutex);
+        file << "{\"traceEvents\":[\n";
+        bool first = true;
+        for (auto& thread : threads) {
+            lock_guard<mutex> lock(thread->eventMutex);
+            size_t count = thread->events.size();
+            for (size_t i = 0; i < count; i++) {
+                const TraceEvent& event = thread->events[(thread->next + i) % count];
+                file << (first ? "" : ",\n") << "{\"name\":\"";
+                writeEscaped(file, event.name);
+                file << "\",\"ph\":\"" << event.phase << "\",\"ts\":" << fixed << event.timestampUs
+                    << ",\"pid\":1,\"tid\":" << thread->threadId;
+                if (event.phase == 'X') {
+                    file << ",\"dur\":" << event.durationUs;
+                }
+                else {
+                    file << ",\"args\":{\"value\":" << event.value << "}";
+                }
+                file << "}";
+                first = false;
+            }
+        }
+        file << "\n]}\n";
+        std::cout << "Trace written to " << path << "\n";
+        return true;
+    }
+};
+
+class ScopedTimer {
+private:
+    const char* name;
+    double startUs;
+public:
+    ScopedTimer(const char* name) : name(name), startUs(Profiler::get().nowUs()) {
+    }
+
+    ~ScopedTimer() {
+        Profiler::get().addScope(name, startUs, Profiler::get().nowUs());
+    }
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ScopedTimer PROFILE_CONCAT(scopedTimer, __LINE__)(name)
+#define PROFILE_COUNTER(name, delta) do { \
+        static ProfileCounter* PROFILE_CONCAT(counter, __LINE__) = Profiler::get().counter(name); \
+        PROFILE_CONCAT(counter, __LINE__)->value += (delta); \
+    } while (0)
+#define PROFILE_SAMPLE_COUNTERS() Profiler::get().sampleCounters()
+#define PROFILE_WRITE_TRACE(path) Profiler::get().writeChromeTrace(path)
+
+#else
+
+#define PROFILE_SCOPE(name)
+#define PROFILE_COUNTER(name, delta) do { } while (0)
+#define PROFILE_SAMPLE_COUNTERS() do { } while (0)
+#define PROFILE_WRITE_TRACE(path) do { } while (0)
+
+#endif
@@ -0,0 +1,173 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include <glm/glm.hpp>
+#include "SparseVoxelOctree.cpp"
+
+using glm::vec3;
+using namespace std;
+
+// ----------------------------------------------------------------------------
+// STRUCTS
+
+struct Ray {
+    vec3 origin;
+    vec3 direction;
+};
+
+struct RayHit {
+    Intersection intersection; // distance is measured from the ray origin
+    bool hit = false;
+};
+
+struct RayBatchStats {
+    int rays = 0;
+    int bins = 0;
+    double sortMs = 0.0;
+    double traceMs = 0.0;
+    double raysPerSecond = 0.0;
+    long long traversalSteps = 0;
+    long long nodeAccesses = 0; // Only counted with a cache model and ENABLE_NODE_VISITOR defined
+    long long cacheMisses = 0;
+};
+
+/*
+* Fully associative LRU cache over 64 byte lines. Hardware counters aren't
+* available portably, so node accesses are replayed through this to compare
+* how well different ray orders reuse the cache.
+*/
+class CacheModel {
+private:
+    size_t lineCount;
+    list<uintptr_t> lru;
+    unordered_map<uintptr_t, list<uintptr_t>::iterator> lines;
+public:
+    long long accesses = 0;
+    long long misses = 0;
+
+    CacheModel(size_t cacheBytes) : lineCount(cacheBytes / 64) {
+    }
+
+    void access(const void* address) {
+        uintptr_t line = reinterpret_cast<uintptr_t>(address) >> 6;
+        accesses++;
+
+        auto found = lines.find(line);
+        if (found != lines.end()) {
+            lru.splice(lru.begin(), lru, found->second);
+            return;
+        }
+
+        misses++;
+        lru.push_front(line);
+        lines[line] = lru.begin();
+        if (lru.size() > lineCount) {
+            lines.erase(lru.back());
+            lru.pop_back();
+        }
+    }
+};
+
+/*
+* Traces large sets of incoherent rays (shadows, reflections, AO) against the SVO.
+* Rays are sorted by direction octant and then by the Morton code of their origin,
+* so rays that walk the same branches of the tree are traced back to back. The
+* results are scattered back to the order the rays were submitted in.
+*/
+class RayBatcher {
+private:
+    SparseVoxelOctree& svo;
+    vector<uint64_t> keys;
+
+    // Number of Morton levels (3 bits each) that decide which bin a ray falls in
+    const int binLevels = 3;
+
+    uint32_t expandBits(uint32_t v) {
+        v = (v | (v << 16)) & 0x030000FFu;
+        v = (v | (v << 8)) & 0x0300F00Fu;
+        v = (v | (v << 4)) & 0x030C30C3u;
+        v = (v | (v << 2)) & 0x09249249u;
+        return v;
+    }
+
+    uint32_t mortonCode(vec3 pos) {
+        vec3 cell = glm::clamp(pos / (float)svo.getSize(), 0.0f, 1.0f) * 511.0f;
+        return expandBits((uint32_t)cell.x) | expandBits((uint32_t)cell.y) << 1 | expandBits((uint32_t)cell.z) << 2;
+    }
+
+    // 3 octant bits above 27 Morton bits (9 per axis), followed by the ray index
+    uint64_t sortKey(const Ray& ray, uint32_t index) {
+        uint32_t octant = (ray.direction.x < 0.0f) | (ray.direction.y < 0.0f) << 1 | (ray.direction.z < 0.0f) << 2;
+        uint64_t key = (uint64_t)octant << 27 | mortonCode(ray.origin);
+        return key << 32 | index;
+    }
+public:
+    RayBatcher(SparseVoxelOctree& svo) : svo(svo) {
+    }
+
+    RayBatchStats trace(const vector<Ray>& rays, vector<RayHit>& hits, bool sortRays = true, CacheModel* cacheModel = nullptr) {
+        PROFILE_SCOPE("RayBatcher::trace");
+        RayBatchStats stats;
+        stats.rays = (int)rays.size();
+        hits.assign(rays.size(), RayHit());
+
+        auto start = chrono::steady_clock::now();
+        keys.resize(rays.size());
+        for (uint32_t i = 0; i < rays.size(); i++) {
+            keys[i] = sortRays ? sortKey(rays[i], i) : i;
+        }
+        if (sortRays) {
+            sort(keys.begin(), keys.end());
+        }
+        auto sorted = chrono::steady_clock::now();
+
+#ifdef ENABLE_NODE_VISITOR
+        // Keep whatever visitor the caller had set and restore it afterwards
+        function<void(const Node*)> previousVisitor = svo.getNodeVisitor();
+        long long accessesBefore = 0, missesBefore = 0;
+        if (cacheModel) {
+            accessesBefore = cacheModel->accesses;
+            missesBefore = cacheModel->misses;
+            svo.setNodeVisitor([cacheModel, previousVisitor](const Node* node) {
+                cacheModel->access(node);
+                if (previousVisitor) previousVisitor(node);
+            });
+        }
+#else
+        (void)cacheModel;
+#endif
+
+        // Bins are runs of rays sharing an octant and the top Morton levels, traced back to back
+        const int binShift = 32 + 27 - 3 * binLevels;
+        uint64_t currentBin = UINT64_MAX;
+        for (uint64_t key : keys) {
+            uint64_t bin = sortRays ? key >> binShift : 0;
+            if (bin != currentBin) {
+                stats.bins++;
+                currentBin = bin;
+            }
+
+            uint32_t index = (uint32_t)(key & 0xFFFFFFFFu);
+            RayHit& hit = hits[index];
+            hit.hit = svo.castRay(rays[index].origin, rays[index].direction, hit.intersection);
+            stats.traversalSteps += hit.intersection.steps;
+        }
+
+#ifdef ENABLE_NODE_VISITOR
+        if (cacheModel) {
+            svo.setNodeVisitor(previousVisitor);
+            stats.nodeAccesses = cacheModel->accesses - accessesBefore;
+            stats.cacheMisses = cacheModel->misses - missesBefore;
+        }
+#endif
+        auto traced = chrono::steady_clock::now();
+
+        stats.sortMs = chrono::duration<double, milli>(sorted - start).count();
+        stats.traceMs = chrono::duration<double, milli>(traced - sorted).count();
+        stats.raysPerSecond = stats.rays / max(1e-9, (stats.sortMs + stats.traceMs) / 1000.0);
+        return stats;
+    }
+};
@@ -0,0 +1,287 @@
+#pragma once
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+#include <glm/glm.hpp>
+#include "SparseVoxelOctree.cpp"
+
+using glm::vec3;
+using glm::mat3;
+using namespace std;
+
+// ----------------------------------------------------------------------------
+// STRUCTS
+
+struct Bounds {
+    vec3 min = vec3(FLT_MAX);
+    vec3 max = vec3(-FLT_MAX);
+};
+
+// Maps local octree space to world space: world = rotation * local + translation
+struct RigidTransform {
+    mat3 rotation = mat3(1.0f);
+    vec3 translation = vec3(0.0f);
+};
+
+struct OctreeInstance {
+    SparseVoxelOctree* octree; // Not owned, several instances can share one octree
+    RigidTransform transform;
+    Bounds worldBounds;
+};
+
+struct BvhNode {
+    Bounds bounds;
+    int left = -1;          // Children are always stored after their parent
+    int right = -1;
+    int firstInstance = 0;  // Range in instanceOrder, only used by leaves
+    int instanceCount = 0;  // 0 for interior nodes
+};
+
+struct SceneIntersection {
+    Intersection intersection; // voxelPos and normal in world space
+    int instance = -1;
+};
+
+struct SceneStats {
+    int bvhNodesVisited = 0;
+    int instancesTested = 0;
+};
+
+/*
+* Two-level scene. Each instance places an SVO in the world with a rigid
+* transform, and a top-level BVH over the instance bounds finds which octrees a
+* ray has to visit. Moving an instance only changes its transform, the BVH is
+* refit every update and only rebuilt when refitting has degraded it too much.
+*/
+class Scene {
+private:
+    vector<OctreeInstance> instances;
+    vector<int> instanceOrder;
+    vector<BvhNode> nodes;
+    bool needsRebuild = false;
+    float builtArea = 0.0f;
+
+    const int maxLeafSize = 2;
+    const float rebuildThreshold = 2.0f;
+
+    float surfaceArea(const Bounds& bounds) {
+        vec3 e = glm::max(bounds.max - bounds.min, vec3(0.0f));
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+
+    void grow(Bounds& bounds, vec3 point) {
+        bounds.min = glm::min(bounds.min, point);
+        bounds.max = glm::max(bounds.max, point);
+    }
+
+    void grow(Bounds& bounds, const Bounds& other) {
+        grow(bounds, other.min);
+        grow(bounds, other.max);
+    }
+
+    vec3 centroid(const Bounds& bounds) {
+        return (bounds.min + bounds.max) * 0.5f;
+    }
+
+    void updateWorldBounds(OctreeInstance& instance) {
+        float size = (float)instance.octree->getSize();
+        instance.worldBounds = Bounds();
+        for (int corner = 0; corner < 8; corner++) {
+            vec3 local((corner & 1) * size, ((corner >> 1) & 1) * size, ((corner >> 2) & 1) * size);
+            grow(instance.worldBounds, instance.transform.rotation * local + instance.transform.translation);
+        }
+    }
+
+    int buildNode(int first, int count) {
+        int index = (int)nodes.size();
+        nodes.push_back(BvhNode());
+
+        Bounds bounds, centroidBounds;
+        for (int i = first; i < first + count; i++) {
+            grow(bounds, instances[instanceOrder[i]].worldBounds);
+            grow(centroidBounds, centroid(instances[instanceOrder[i]].worldBounds));
+        }
+        nodes[index].bounds = bounds;
+
+        if (count <= maxLeafSize) {
+            nodes[index].firstInstance = first;
+            nodes[index].instanceCount = count;
+            return index;
+        }
+
+        // Median split along the longest axis of the centroids
+        vec3 extent = centroidBounds.max - centroidBounds.min;
+        int axis = 0;
+        if (extent.y > extent.x) axis = 1;
+        if (extent.z > extent[axis]) axis = 2;
+
+        int half = count / 2;
+        nth_element(instanceOrder.begin() + first, instanceOrder.begin() + first + half, instanceOrder.begin() + first + count,
+            [&](int a, int b) {
+                return centroid(instances[a].worldBounds)[axis] < centroid(instances[b].worldBounds)[axis];
+            });
+
+        int left = buildNode(first, half);
+        int right = buildNode(first + half, count - half);
+        nodes[index].left = left;
+        nodes[index].right = right;
+        return index;
+    }
+
+    float totalArea() {
+        float area = 0.0f;
+        for (const BvhNode& node : nodes) {
+            area += surfaceArea(node.bounds);
+        }
+        return area;
+    }
+
+    void rebuild() {
+        nodes.clear();
+        instanceOrder.resize(instances.size());
+        for (int i = 0; i < (int)instances.size(); i++) {
+            instanceOrder[i] = i;
+            updateWorldBounds(instances[i]);
+        }
+        if (!instances.empty()) {
+            buildNode(0, (int)instances.size());
+        }
+        builtArea = totalArea();
+        needsRebuild = false;
+    }
+
+    void refit() {
+        for (OctreeInstance& instance : instances) {
+            updateWorldBounds(instance);
+        }
+
+        // Children come after their parents, so walking backwards visits children first
+        for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+            BvhNode& node = nodes[i];
+            node.bounds = Bounds();
+            if (node.instanceCount > 0) {
+                for (int j = node.firstInstance; j < node.firstInstance + node.instanceCount; j++) {
+                    grow(node.bounds, instances[instanceOrder[j]].worldBounds);
+                }
+            }
+            else {
+                grow(node.bounds, nodes[node.left].bounds);
+                grow(node.bounds, nodes[node.right].bounds);
+            }
+        }
+    }
+
+    bool intersectBounds(const Bounds& bounds, vec3 origin, vec3 invD, float tMax, float& tEnter) {
+        vec3 t0 = (bounds.min - origin) * invD;
+        vec3 t1 = (bounds.max - origin) * invD;
+        vec3 tNear = glm::min(t0, t1);
+        vec3 tFar = glm::max(t0, t1);
+        tEnter = max({ tNear.x, tNear.y, tNear.z, 0.0f });
+        float tExit = min({ tFar.x, tFar.y, tFar.z, tMax });
+        return tEnter <= tExit;
+    }
+
+    // Traverses one instance in its local space, t is the same in both spaces since the transform is rigid
+    bool intersectInstance(const OctreeInstance& instance, vec3 origin, vec3 d, float tMax, Intersection& intersection) {
+        mat3 toLocal = glm::transpose(instance.transform.rotation);
+        vec3 localOrigin = toLocal * (origin - instance.transform.translation);
+        vec3 localD = toLocal * d;
+
+        if (!instance.octree->castRay(localOrigin, localD, intersection, tMax)) {
+            return false;
+        }
+
+        intersection.voxelPos = instance.transform.rotation * intersection.voxelPos + instance.transform.translation;
+        intersection.normal = instance.transform.rotation * intersection.normal;
+        return true;
+    }
+public:
+    int addInstance(SparseVoxelOctree* octree, RigidTransform transform) {
+        OctreeInstance instance;
+        instance.octree = octree;
+        instance.transform = transform;
+        updateWorldBounds(instance);
+        instances.push_back(instance);
+        needsRebuild = true;
+        return (int)instances.size() - 1;
+    }
+
+    void setTransform(int instance, RigidTransform transform) {
+        instances[instance].transform = transform;
+    }
+
+    const RigidTransform& getTransform(int instance) {
+        return instances[instance].transform;
+    }
+
+    int getInstanceCount() {
+        return (int)instances.size();
+    }
+
+    // Call once per frame after moving instances
+    void update() {
+        PROFILE_SCOPE("Scene::update");
+        if (needsRebuild) {
+            rebuild();
+            return;
+        }
+
+        refit();
+        if (totalArea() > builtArea * rebuildThreshold) {
+            rebuild();
+        }
+    }
+
+    bool ClosestIntersection(vec3 origin, vec3 d, SceneIntersection& hit, SceneStats* stats = nullptr) {
+        if (nodes.empty()) return false;
+
+        const float tiny = 1e-8f;
+        vec3 invD;
+        for (int axis = 0; axis < 3; axis++) {
+            invD[axis] = 1.0f / (abs(d[axis]) < tiny ? copysign(tiny, d[axis]) : d[axis]);
+        }
+        float closest = FLT_MAX;
+        hit.instance = -1;
+
+        int stack[64];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+
+        while (stackSize > 0) {
+            const BvhNode& node = nodes[stack[--stackSize]];
+            float tEnter;
+            if (!intersectBounds(node.bounds, origin, invD, closest, tEnter)) continue;
+            if (stats) stats->bvhNodesVisited++;
+
+            if (node.instanceCount > 0) {
+                for (int i = node.firstInstance; i < node.firstInstance + node.instanceCount; i++) {
+                    Intersection intersection;
+                    if (stats) stats->instancesTested++;
+                    if (intersectInstance(instances[instanceOrder[i]], origin, d, closest, intersection)) {
+                        closest = intersection.distance;
+                        hit.intersection = intersection;
+                        hit.instance = instanceOrder[i];
+                    }
+                }
+                continue;
+            }
+
+            // Push the far child first so the near one is visited first
+            float tLeft, tRight;
+            bool hitLeft = intersectBounds(nodes[node.left].bounds, origin, invD, closest, tLeft);
+            bool hitRight = intersectBounds(nodes[node.right].bounds, origin, invD, closest, tRight);
+            if (hitLeft && hitRight) {
+                bool leftFirst = tLeft <= tRight;
+                stack[stackSize++] = leftFirst ? node.right : node.left;
+                stack[stackSize++] = leftFirst ? node.left : node.right;
+            }
+            else if (hitLeft) {
+                stack[stackSize++] = node.left;
+            }
+            else if (hitRight) {
+                stack[stackSize++] = node.right;
+            }
+        }
+        return hit.instance >= 0;
+    }
+};
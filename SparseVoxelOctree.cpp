@@ -1,15 +1,19 @@
+#pragma once
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <cfloat>
 #include <PerlinNoise.hpp>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <bitset>
+#include <functional>
+#include "Profiler.cpp"
 
 using glm::vec3;
 using glm::ivec3;
@@ -27,6 +31,8 @@ struct Intersection {
     vec3 normal;
     vec3 voxelPos;
     vec3 color;
+    float distance = 0.0f; // Ray parameter of the hit, relative to the start position
+    int steps = 0;         // Traversal steps taken, also set when nothing is hit
 };
 
 struct Node {
@@ -51,11 +57,15 @@ private:
     int svoSize;
     int maxDepth;
     Node* root;
+#ifdef ENABLE_NODE_VISITOR
+    function<void(const Node*)> nodeVisitor;
+#endif
 
     void insertNode(Node*& node, vec3 point, ivec3 pos, vec3 color, int depth) {
         if (!node) {
             node = new Node;
             node->depth = depth;
+            PROFILE_COUNTER("nodes allocated", 1);
         }
 
         // Stop subdivision at max depth
@@ -71,6 +81,7 @@ private:
             if (!node->children[i]) {
                 node->children[i] = new Node;
                 node->children[i]->depth = depth + 1;
+                PROFILE_COUNTER("nodes allocated", 1);
                 //cout << node->children[i] << "\n";
             }
         }
@@ -142,14 +153,30 @@ public:
         return maxDepth;
     }
 
+#ifdef ENABLE_NODE_VISITOR
+    // Called for every node touched during lookups, used to model cache behaviour.
+    // Only compiled in with ENABLE_NODE_VISITOR so normal traversal doesn't pay for it.
+    void setNodeVisitor(function<void(const Node*)> visitor) {
+        nodeVisitor = visitor;
+    }
+
+    const function<void(const Node*)>& getNodeVisitor() {
+        return nodeVisitor;
+    }
+#endif
+
     Node* getNodeAtPos(vec3 pos) {
         int depth = 0;
         vec3 offset = vec3(0.0f, 0.0f, 0.0f);
         Node* node = root;
         Node* lastValidNode = node;
+        if (!root) return nullptr;
 
         while (true) {
             lastValidNode = node;  // update the deepest node we've reached
+#ifdef ENABLE_NODE_VISITOR
+            if (nodeVisitor) nodeVisitor(node);
+#endif
 
             float nodeSize = svoSize / (float)(1 << depth);
             vec3 center = offset + vec3(nodeSize, nodeSize, nodeSize) * 0.5f;
@@ -186,6 +213,43 @@ public:
         return lastValidNode;
     }
 
+    // Clips a ray against the bounds of the octree, tEnter is 0 when starting inside
+    bool clipRay(vec3 pos, vec3 d, float& tEnter) {
+        float tMin = 0.0f;
+        float tMax = FLT_MAX;
+        for (int axis = 0; axis < 3; axis++) {
+            if (abs(d[axis]) < 1e-8f) {
+                if (pos[axis] < 0.0f || pos[axis] > svoSize) return false;
+                continue;
+            }
+            float t0 = (0.0f - pos[axis]) / d[axis];
+            float t1 = (svoSize - pos[axis]) / d[axis];
+            if (t0 > t1) swap(t0, t1);
+            tMin = max(tMin, t0);
+            tMax = min(tMax, t1);
+            if (tMin > tMax) return false;
+        }
+        tEnter = tMin;
+        return true;
+    }
+
+    // Casts a ray from anywhere, hit distance is measured from the origin
+    bool castRay(vec3 origin, vec3 d, Intersection& intersection, float maxDistance = FLT_MAX) {
+        float tEnter;
+        intersection.steps = 0;
+        if (!clipRay(origin, d, tEnter) || tEnter > maxDistance) {
+            return false;
+        }
+
+        // Nudge the start just inside the volume so the traversal bounds check passes
+        float startT = tEnter + svoSize * 1e-5f;
+        if (!ClosestIntersection(origin + d * startT, d, intersection)) {
+            return false;
+        }
+        intersection.distance += startT;
+        return intersection.distance <= maxDistance;
+    }
+
     void printVec(string name, vec3 pos) {
         cout << name << ": " << pos.x << ", " << pos.y << ", " << pos.z << "\n";
     }
@@ -195,9 +259,11 @@ public:
         return a / (abs(b) < tiny ? copysign(tiny, b) : b);
     }
 
-    bool ClosestIntersection(vec3 pos, vec3 d, Intersection& intersection) {
-        int maxSteps = 100;
+    bool ClosestIntersection(vec3 pos, vec3 d, Intersection& intersection, int maxSteps = 100) {
         vec3 normal = vec3(0);
+        vec3 start = pos;
+        intersection.steps = 0;
+        if (!root) return false;
 
         // Small offset to avoid exact axis-alignment
         const float rayEpsilon = 1e-5f;
@@ -211,6 +277,7 @@ public:
 
         for (int i = 0; i < maxSteps; i++) {
             Node* node = getNodeAtPos(pos);
+            intersection.steps = i + 1;
 
             const float epsilon = 1e-5f;
             float increment = svoSize / (float)exp2(node->depth);
@@ -223,6 +290,7 @@ public:
                 intersection.voxelPos = voxelCenter;
                 intersection.normal = normal;
                 intersection.color = node->color;
+                intersection.distance = glm::dot(pos - start, d) / glm::dot(d, d);
                 return true;
             }
             if (!(pos.x >= 0.0f && pos.x <= svoSize &&
@@ -287,6 +355,7 @@ public:
     }
 
     void insert(vec3 point, vec3 color) {
+        PROFILE_COUNTER("voxels inserted", 1);
         //cout << root;
         Node* node = getNodeAtPos(point);
         int depth = 0;
@@ -296,13 +365,18 @@ public:
     }
 
     vector<FlatNode> toFlatArray() {
+        PROFILE_SCOPE("SparseVoxelOctree::toFlatArray");
         vector<FlatNode> flatNodes;
         flattenSVO(root, flatNodes);
+        PROFILE_COUNTER("bytes flattened (FlatNode)", flatNodes.size() * sizeof(FlatNode));
         return flatNodes;
     }
 
     vector<uint64_t> toFlatIntArray() {
-        vector<FlatNode> flatArray = toFlatArray();
+        PROFILE_SCOPE("SparseVoxelOctree::toFlatIntArray");
+        // Flatten directly so the FlatNode counter only counts toFlatArray output
+        vector<FlatNode> flatArray;
+        flattenSVO(root, flatArray);
         vector<uint64_t> flatIntArray;
         for (int i = 0; i < flatArray.size(); i++) {
             uint64_t node = (uint64_t(flatArray[i].color) << 56) |
@@ -311,6 +385,7 @@ public:
                 (uint64_t(flatArray[i].firstChildIndex) & 0x00FFFFFF);
             flatIntArray.push_back(node);
         }
+        PROFILE_COUNTER("bytes flattened (packed)", flatIntArray.size() * sizeof(uint64_t));
         return flatIntArray;
     }
 };
\ No newline at end of file
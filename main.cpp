@@ -10,12 +10,29 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <bitset>
+#include <random>
 #include "../SparseVoxelOctree.cpp"
+#include "../CpuRenderer.cpp"
+#include "../Scene.cpp"
+#include "../RayBatch.cpp"
+#include "../NodeUploader.cpp"
 
 using glm::vec3;
 using glm::ivec3;
 using namespace std;
 
+// Render the SVO with the CPU ray caster instead of the shader path, toggled with C
+bool cpuRenderMode = false;
+const double cpuTargetFrameMs = 33.3;
+// Run the scripted camera paths with and without the reprojection cache before opening the window
+const bool runReprojectionBenchmark = false;
+// Move thousands of instanced props through a two-level scene and trace them
+const bool runSceneBenchmark = false;
+// Trace ambient occlusion rays unsorted and sorted through the ray batcher
+const bool runRayBatchBenchmark = false;
+// Edit the SVO over several frames and upload it through the in-memory backend
+const bool runUploadBenchmark = false;
+
 // ----------------------------------------------------------------------------
 // FUNCTIONS
 
@@ -87,6 +104,7 @@ void createPerlinTerrain(SparseVoxelOctree& svo, float heightScaling) {
     std::cout << "uint32 seed      = ";
     std::cin >> seed;
 
+    PROFILE_SCOPE("createPerlinTerrain");
     const siv::PerlinNoise perlin{ seed };
     const float voxelSize = svo.getSize() / (float)exp2(svo.getMaxDepth());
     const int width = 1 / voxelSize;
@@ -96,7 +114,8 @@ void createPerlinTerrain(SparseVoxelOctree& svo, float heightScaling) {
     vec3 groundColor(0.46f, 0.64f, 0.38f);
     float step = voxelSize;
 
-
+    // One scope for the whole loop, a scope per insert would swamp the trace
+    PROFILE_SCOPE("createPerlinTerrain inserts");
     for (int y = 0; y < width; ++y)
     {
         for (int x = 0; x < width; ++x)
@@ -130,6 +149,232 @@ SparseVoxelOctree createSVO() {
     return svo;
 }
 
+Camera makeCamera(vec3 position, vec3 target) {
+    Camera camera;
+    camera.position = position;
+    camera.forward = glm::normalize(target - position);
+    return camera;
+}
+
+void benchmarkCameraPath(SparseVoxelOctree& svo, string name, const vector<Camera>& path, int frames) {
+    // Both renderers run side by side at a fixed resolution so they trace the same rays,
+    // and the cached frames are compared pixel by pixel against the uncached ones
+    CpuRenderer uncached(svo, 320, 240, 1000.0);
+    CpuRenderer cached(svo, 320, 240, 1000.0);
+    CpuRenderer* renderers[2] = { &uncached, &cached };
+    for (int pass = 0; pass < 2; pass++) {
+        renderers[pass]->setScaleLimits(1.0f, 1.0f);
+        renderers[pass]->setTemporalReprojection(pass == 1);
+    }
+
+    double totalMs[2] = { 0.0, 0.0 };
+    long long rays = 0, steps[2] = { 0, 0 }, cacheHits = 0, cacheRejects = 0, cacheMisses = 0, savedSteps = 0;
+    long long mismatchedPixels = 0;
+    int mismatchedFrames = 0, worstFrame = 0;
+    for (int i = 0; i < frames; i++) {
+        Camera camera = cameraOnPath(path, i / (float)(frames - 1));
+        const vector<uint32_t>& reference = uncached.renderFrame(camera);
+        const vector<uint32_t>& frame = cached.renderFrame(camera);
+
+        for (int pass = 0; pass < 2; pass++) {
+            const FrameStats& stats = renderers[pass]->getLastFrameStats();
+            totalMs[pass] += stats.frameMs;
+            steps[pass] += stats.traversalSteps;
+        }
+        const FrameStats& stats = cached.getLastFrameStats();
+        rays += stats.raysCast;
+        cacheHits += stats.cacheHits;
+        cacheRejects += stats.cacheRejects;
+        cacheMisses += stats.cacheMisses;
+        savedSteps += stats.savedSteps;
+
+        int mismatched = 0;
+        for (size_t p = 0; p < frame.size(); p++) {
+            mismatched += frame[p] != reference[p];
+        }
+        mismatchedPixels += mismatched;
+        mismatchedFrames += mismatched > 0;
+        worstFrame = max(worstFrame, mismatched);
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        cout << name << (pass == 1 ? " [cache on]  " : " [cache off] ")
+            << "avg " << totalMs[pass] / frames << " ms"
+            << " | steps/ray " << steps[pass] / (double)rays;
+        if (pass == 1) {
+            cout << " | hit rate " << 100.0 * cacheHits / rays << "%"
+                << " | rejects " << cacheRejects << " | not reprojected " << cacheMisses
+                << " | saved steps " << savedSteps;
+        }
+        cout << "\n";
+    }
+    cout << name << " mismatched pixels " << mismatchedPixels << " in " << mismatchedFrames << "/" << frames
+        << " frames | worst frame " << worstFrame << "\n";
+}
+
+void benchmarkReprojection(SparseVoxelOctree& svo) {
+    vec3 center(0.5f, 0.05f, 0.5f);
+
+    vector<Camera> orbit;
+    for (int i = 0; i <= 8; i++) {
+        float angle = i * 0.1f;
+        orbit.push_back(makeCamera(center + vec3(cos(angle), 0.4f, sin(angle)) * 0.9f, center));
+    }
+    benchmarkCameraPath(svo, "orbit", orbit, 120);
+
+    vector<Camera> dolly = {
+        makeCamera(vec3(0.5f, 0.3f, -0.4f), center),
+        makeCamera(vec3(0.5f, 0.2f, 0.1f), center + vec3(0.0f, 0.0f, 0.3f)),
+    };
+    benchmarkCameraPath(svo, "dolly", dolly, 120);
+
+    vector<Camera> pan = {
+        makeCamera(vec3(0.2f, 0.25f, 0.2f), vec3(0.8f, 0.0f, 0.5f)),
+        makeCamera(vec3(0.2f, 0.25f, 0.2f), vec3(0.5f, 0.0f, 0.8f)),
+    };
+    benchmarkCameraPath(svo, "pan", pan, 120);
+}
+
+void benchmarkScene() {
+    // All props share one small octree, only their transforms change
+    SparseVoxelOctree prop(1, 4);
+    createSphere(prop, vec3(0.5f, 0.5f, 0.5f), 0.4f, 16);
+
+    Scene scene;
+    const int gridSize = 48;
+    for (int x = 0; x < gridSize; x++) {
+        for (int z = 0; z < gridSize; z++) {
+            RigidTransform transform;
+            transform.translation = vec3(x * 2.0f, 0.0f, z * 2.0f);
+            scene.addInstance(&prop, transform);
+        }
+    }
+
+    const int frames = 30;
+    const int width = 160, height = 120;
+    double updateMs = 0.0, traceMs = 0.0;
+    long long hits = 0;
+    SceneStats stats;
+    for (int frame = 0; frame < frames; frame++) {
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < scene.getInstanceCount(); i++) {
+            RigidTransform transform = scene.getTransform(i);
+            float angle = frame * 0.05f + i;
+            transform.rotation = glm::mat3(glm::rotate(glm::mat4(1.0f), angle, vec3(0.0f, 1.0f, 0.0f)));
+            transform.translation.y = sin(angle) * 0.5f;
+            scene.setTransform(i, transform);
+        }
+        scene.update();
+        auto updated = chrono::steady_clock::now();
+
+        vec3 origin(gridSize, 6.0f, -4.0f);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                vec3 d = glm::normalize(vec3((x - width / 2) / (float)width, (y - height / 2) / (float)height - 0.3f, 1.0f));
+                SceneIntersection hit;
+                hits += scene.ClosestIntersection(origin, d, hit, &stats) ? 1 : 0;
+            }
+        }
+        auto traced = chrono::steady_clock::now();
+        updateMs += chrono::duration<double, milli>(updated - start).count();
+        traceMs += chrono::duration<double, milli>(traced - updated).count();
+    }
+
+    long long rays = (long long)frames * width * height;
+    cout << "scene: " << scene.getInstanceCount() << " instances"
+        << " | update " << updateMs / frames << " ms"
+        << " | trace " << traceMs / frames << " ms"
+        << " | hits " << hits << "/" << rays
+        << " | bvh nodes/ray " << stats.bvhNodesVisited / (double)rays
+        << " | instances/ray " << stats.instancesTested / (double)rays << "\n";
+}
+
+void printRayBatchStats(string name, const RayBatchStats& stats) {
+    cout << name << " | bins " << stats.bins
+        << " | sort " << stats.sortMs << " ms | trace " << stats.traceMs << " ms"
+        << " | " << stats.raysPerSecond / 1e6 << " Mrays/s"
+        << " | steps " << stats.traversalSteps;
+    if (stats.nodeAccesses > 0) {
+        cout << " | modelled cache misses " << 100.0 * stats.cacheMisses / stats.nodeAccesses << "%";
+    }
+    cout << "\n";
+}
+
+void benchmarkRayBatching(SparseVoxelOctree& svo) {
+    // Ambient occlusion rays from the primary hits of a view over the terrain
+    Camera camera = makeCamera(vec3(0.5f, 0.4f, -0.2f), vec3(0.5f, 0.05f, 0.5f));
+    vec3 right = glm::normalize(glm::cross(camera.forward, camera.up));
+    vec3 up = glm::cross(right, camera.forward);
+    float halfHeight = tan(camera.fov * 0.5f);
+
+    vector<Ray> rays;
+    const int samplesPerHit = 8;
+    for (int y = 0; y < 240; y++) {
+        for (int x = 0; x < 320; x++) {
+            float u = ((x + 0.5f) / 320) * 2.0f - 1.0f;
+            float v = ((y + 0.5f) / 240) * 2.0f - 1.0f;
+            vec3 d = glm::normalize(camera.forward + right * (u * halfHeight * 320 / 240.0f) + up * (v * halfHeight));
+            Intersection primary;
+            if (!svo.castRay(camera.position, d, primary) || primary.normal == vec3(0.0f)) continue;
+
+            vec3 hitPos = camera.position + d * primary.distance + primary.normal * 1e-3f;
+            for (int i = 0; i < samplesPerHit; i++) {
+                vec3 dir = glm::normalize(vec3(rand() / (float)RAND_MAX - 0.5f, rand() / (float)RAND_MAX - 0.5f, rand() / (float)RAND_MAX - 0.5f));
+                if (glm::dot(dir, primary.normal) < 0.0f) dir = -dir;
+                rays.push_back({ hitPos, dir });
+            }
+        }
+    }
+    shuffle(rays.begin(), rays.end(), mt19937(1234));
+    cout << "ray batching: " << rays.size() << " ambient occlusion rays\n";
+
+    RayBatcher batcher(svo);
+    vector<RayHit> unsortedHits, sortedHits;
+    printRayBatchStats("unsorted", batcher.trace(rays, unsortedHits, false));
+    printRayBatchStats("sorted  ", batcher.trace(rays, sortedHits, true));
+
+#ifdef ENABLE_NODE_VISITOR
+    // Replay the node accesses through a 32 KB cache model, much slower so timed separately
+    CacheModel unsortedCache(32 * 1024), sortedCache(32 * 1024);
+    printRayBatchStats("unsorted (cache model)", batcher.trace(rays, unsortedHits, false, &unsortedCache));
+    printRayBatchStats("sorted   (cache model)", batcher.trace(rays, sortedHits, true, &sortedCache));
+#else
+    cout << "define ENABLE_NODE_VISITOR for modelled cache misses\n";
+#endif
+}
+
+void benchmarkNodeUpload(SparseVoxelOctree& svo) {
+    MemoryUploadBackend backend;
+    NodeBufferUploader uploader(backend);
+
+    vector<uint64_t> nodes = svo.toFlatIntArray();
+    const UploadStats& initial = uploader.upload(nodes);
+    cout << "node upload: initial " << initial.bytesUploaded << " bytes\n";
+
+    const int frames = 20;
+    const int editsPerFrame = 16;
+    size_t totalBytes = 0;
+    double totalStallMs = 0.0;
+    for (int frame = 0; frame < frames; frame++) {
+        for (int i = 0; i < editsPerFrame; i++) {
+            vec3 point(rand() / (float)RAND_MAX, 0.5f + 0.5f * rand() / (float)RAND_MAX, rand() / (float)RAND_MAX);
+            svo.insert(point, vec3(0.0f, 0.0f, 1.0f));
+        }
+        nodes = svo.toFlatIntArray();
+        const UploadStats& stats = uploader.upload(nodes);
+        totalBytes += stats.bytesUploaded;
+        totalStallMs += stats.stallMs;
+
+        cout << "frame " << frame << " | " << stats.bytesUploaded << "/" << nodes.size() * sizeof(uint64_t) << " bytes"
+            << " | ranges " << stats.rangesUploaded << " | slots " << stats.slotsUsed
+            << " | stall " << stats.stallMs << " ms" << (stats.reallocated ? " | reallocated" : "") << "\n";
+    }
+
+    bool matches = memcmp(backend.getBuffer().data(), nodes.data(), nodes.size() * sizeof(uint64_t)) == 0;
+    cout << "average " << totalBytes / frames << " bytes/frame | stall " << totalStallMs / frames << " ms/frame"
+        << " | stalled waits " << backend.stalledWaits << " | buffer " << (matches ? "matches" : "DOES NOT MATCH") << "\n";
+}
+
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
     glViewport(0, 0, width, height);
@@ -139,6 +384,25 @@ void processInput(GLFWwindow* window) {
     if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
         glfwSetWindowShouldClose (window, true);
     }
+
+    // Write the profiling trace once per press of P
+    static bool traceKeyDown = false;
+    bool traceKeyPressed = glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS;
+    if (traceKeyPressed && !traceKeyDown) {
+        PROFILE_WRITE_TRACE("trace.json");
+    }
+    traceKeyDown = traceKeyPressed;
+
+    // Switch between the shader path and the CPU ray caster once per press of C
+    static bool cpuKeyDown = false;
+    bool cpuKeyPressed = glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS;
+    if (cpuKeyPressed && !cpuKeyDown) {
+        cpuRenderMode = !cpuRenderMode;
+        if (!cpuRenderMode) {
+            glfwSetWindowTitle(window, "DH2323 Project");
+        }
+    }
+    cpuKeyDown = cpuKeyPressed;
 }
 
 float vertices[] = {
@@ -153,6 +417,7 @@ unsigned int indices[] = {  // note that we start from 0!
 };
 
 string readShaderSource(const std::string& filepath) {
+    PROFILE_SCOPE("readShaderSource");
     ifstream file(filepath);
     stringstream buffer;
 
@@ -166,6 +431,7 @@ string readShaderSource(const std::string& filepath) {
 }
 
 GLuint compileShader(GLenum shaderType, const string& path) {
+    PROFILE_SCOPE("compileShader");
     GLuint shader = glCreateShader(shaderType);
     const char* src = path.c_str();
     glShaderSource(shader, 1, &src, NULL);
@@ -184,6 +450,7 @@ GLuint compileShader(GLenum shaderType, const string& path) {
 }
 
 GLuint createShaderProgram(GLuint vertexShader, GLuint fragmentShader) {
+    PROFILE_SCOPE("createShaderProgram");
     GLint success;
     char infoLog[512];
     GLuint shaderProgram = glCreateProgram();
@@ -207,15 +474,29 @@ int main()
     vector<FlatNode> svoArray = svo.toFlatArray();
     //printFlatSVO(svoArray);
 
-    vector<uint32_t> flatIntArray = svo.toFlatIntArray();
+    vector<uint64_t> flatIntArray = svo.toFlatIntArray();
 
     //for (int i = 0; i < svoArray.size(); i++) {
     //    cout << svoArray[i] << ", ";
     //}
+    PROFILE_SAMPLE_COUNTERS();
+
+    if (runReprojectionBenchmark) {
+        benchmarkReprojection(svo);
+    }
+    if (runSceneBenchmark) {
+        benchmarkScene();
+    }
+    if (runRayBatchBenchmark) {
+        benchmarkRayBatching(svo);
+    }
+    if (runUploadBenchmark) {
+        benchmarkNodeUpload(svo);
+    }
 
     glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
     GLFWwindow* window = glfwCreateWindow(800, 600, "DH2323 Project", NULL, NULL);
@@ -254,6 +535,13 @@ int main()
     glDeleteShader(vertexShader);
     glDeleteShader(fragmentShader);
 
+    // Upload the flattened SVO to binding 0, later uploads only send the ranges that changed.
+    // fragment.frag doesn't decode the toFlatIntArray packing yet, so the shader can't read it.
+    GLUploadBackend nodeBackend(0);
+    NodeBufferUploader nodeUploader(nodeBackend);
+    const UploadStats& uploadStats = nodeUploader.upload(flatIntArray);
+    cout << "Uploaded " << uploadStats.bytesUploaded << " bytes of SVO nodes\n";
+
     GLuint VBOs[2], VAOs[2];
     glGenVertexArrays(2, VAOs); // we can also generate multiple VAOs or buffers at the same time
     glGenBuffers(2, VBOs);
@@ -270,13 +558,55 @@ int main()
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
 
+    // The CPU frame is uploaded to a texture and blitted to the screen through a framebuffer
+    CpuRenderer cpuRenderer(svo, 800, 600, cpuTargetFrameMs);
+    GLuint cpuTexture, cpuFramebuffer;
+    glGenTextures(1, &cpuTexture);
+    glBindTexture(GL_TEXTURE_2D, cpuTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, cpuRenderer.getOutputWidth(), cpuRenderer.getOutputHeight(), 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glGenFramebuffers(1, &cpuFramebuffer);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, cpuFramebuffer);
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, cpuTexture, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
     while (!glfwWindowShouldClose(window))
     {
+        PROFILE_SCOPE("frame");
         processInput(window);
 
         glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT);
 
+        if (cpuRenderMode) {
+            // Slowly orbit the camera around the middle of the volume
+            float angle = (float)glfwGetTime() * 0.2f;
+            vec3 center(0.5f, 0.05f, 0.5f);
+            Camera camera;
+            camera.position = center + vec3(cos(angle), 0.4f, sin(angle)) * 0.9f;
+            camera.forward = glm::normalize(center - camera.position);
+
+            const vector<uint32_t>& frame = cpuRenderer.renderFrame(camera);
+            glBindTexture(GL_TEXTURE_2D, cpuTexture);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, cpuRenderer.getOutputWidth(), cpuRenderer.getOutputHeight(), GL_RGBA, GL_UNSIGNED_BYTE, frame.data());
+
+            int width, height;
+            glfwGetFramebufferSize(window, &width, &height);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, cpuFramebuffer);
+            glBlitFramebuffer(0, 0, cpuRenderer.getOutputWidth(), cpuRenderer.getOutputHeight(), 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+            const FrameStats& stats = cpuRenderer.getLastFrameStats();
+            string title = "DH2323 Project | " + to_string(stats.internalWidth) + "x" + to_string(stats.internalHeight)
+                + " | " + to_string((int)stats.frameMs) + "/" + to_string((int)stats.targetMs) + " ms"
+                + " | hits " + to_string(stats.hits) + "/" + to_string(stats.raysCast);
+            glfwSetWindowTitle(window, title.c_str());
+            PROFILE_SAMPLE_COUNTERS();
+
+            glfwSwapBuffers(window);
+            glfwPollEvents();
+            continue;
+        }
+
         glUseProgram(shaderProgram);
 
         glm::mat4 trans = glm::mat4(1.0f);
@@ -294,6 +624,9 @@ int main()
     glDeleteVertexArrays(2, VAOs);
     glDeleteBuffers(2, VAOs);
     glDeleteProgram(shaderProgram);
+    glDeleteFramebuffers(1, &cpuFramebuffer);
+    glDeleteTextures(1, &cpuTexture);
+    nodeBackend.release();
 
     glfwTerminate();
 